@@ -0,0 +1,327 @@
+"""Replays key traces against a local PS shard and reports its performance.
+
+Batches come either from a recorded trace or from a synthetic Zipf
+distribution, and are sent as PSPull/PSPush runs by several concurrent
+callers sharing one tf.Session (and therefore one shard). At the end the
+tool prints throughput, latency percentiles, failed runs by error type and
+the shard size, memory and bucket count sampled over time.
+
+Trace files have one batch per line: an optional `pull` or `push` followed
+by whitespace separated int64 keys. Lines without an op get one drawn from
+--pull-ratio. `--record` writes the synthetic batches in the same format so
+a run can be replayed later.
+
+  python ps_loadgen.py --num-keys 10000000 --zipf 1.1 --batch-size 4096 \\
+      --sessions 8 --duration 60 --report report.json
+"""
+from __future__ import division
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import sys
+import threading
+import timeit
+
+import numpy as np
+import tensorflow as tf
+
+from tfop_lib import load_ops
+
+_PERCENTILES = [50, 90, 99, 99.9]
+_GOLDEN = np.uint64(0x9E3779B97F4A7C15)
+_KEY_MASK = np.uint64(0x7FFFFFFFFFFFFFFF)
+
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('--lib', help='op library, see tfop_lib.find_library')
+    parser.add_argument('--trace', help='trace file to replay')
+    parser.add_argument('--record', help='write the synthetic trace here')
+    parser.add_argument('--num-keys', type=int, default=1000000,
+                        help='distinct keys of the synthetic trace')
+    parser.add_argument('--zipf', type=float, default=1.0,
+                        help='Zipf exponent, 0 for uniform')
+    parser.add_argument('--batch-size', type=int, default=1024)
+    parser.add_argument('--pull-ratio', type=float, default=0.8,
+                        help='fraction of batches that are pulls')
+    parser.add_argument('--sessions', type=int, default=4,
+                        help='concurrent callers of session.run')
+    parser.add_argument('--duration', type=float, default=30.0,
+                        help='seconds to run, the trace loops until then')
+    parser.add_argument('--warmup', type=float, default=3.0,
+                        help='seconds excluded from the statistics')
+    parser.add_argument('--sample-interval', type=float, default=1.0,
+                        help='seconds between shard memory samples')
+    parser.add_argument('--insert-on-miss', action='store_true',
+                        help='pull with insert_on_miss and a uniform init')
+    parser.add_argument('--num-partitions', type=int, default=16)
+    parser.add_argument('--numa-node', default='')
+    parser.add_argument('--num-numa-threads', type=int, default=0)
+    parser.add_argument('--memory-budget', type=int, default=0,
+                        help='memory_budget_bytes of the shard')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--report', help='also write the report as JSON')
+    parser.add_argument('--native-stdout', action='store_true',
+                        help='keep the op library output on stdout')
+    return parser.parse_args(argv)
+
+
+class ZipfTrace(object):
+    """Endless synthetic batches with Zipf distributed key popularity."""
+
+    def __init__(self, args, cdf, seed):
+        self._rng = np.random.RandomState(seed)
+        self._batch_size = args.batch_size
+        self._pull_ratio = args.pull_ratio
+        self._cdf = cdf
+
+    @staticmethod
+    def popularity_cdf(num_keys, exponent):
+        ranks = np.arange(1, num_keys + 1, dtype=np.float64)
+        cdf = np.cumsum(ranks ** -exponent)
+        return cdf / cdf[-1]
+
+    def next_batch(self):
+        ranks = np.searchsorted(self._cdf, self._rng.random_sample(
+            self._batch_size)).astype(np.uint64)
+        # Scatter the ranks over the key space, so hot keys are not
+        # neighbouring ids.
+        with np.errstate(over='ignore'):
+            keys = ((ranks + np.uint64(1)) * _GOLDEN) & _KEY_MASK
+        op = 'pull' if self._rng.random_sample() < self._pull_ratio else 'push'
+        return op, keys.astype(np.int64)
+
+
+class FileTrace(object):
+    """Replays every `stride`-th line of a trace file, starting at `offset`."""
+
+    def __init__(self, args, path, offset, stride, seed):
+        self._rng = np.random.RandomState(seed)
+        self._pull_ratio = args.pull_ratio
+        self._batches = []
+        with open(path) as f:
+            for i, line in enumerate(f):
+                tokens = line.split()
+                if i % stride != offset or not tokens:
+                    continue
+                op = None
+                if tokens[0] in ('pull', 'push'):
+                    op, tokens = tokens[0], tokens[1:]
+                self._batches.append((op, np.array(tokens, dtype=np.int64)))
+        if not self._batches:
+            raise ValueError('trace %s has no batch for session %d'
+                             % (path, offset))
+        self._next = 0
+
+    def next_batch(self):
+        op, keys = self._batches[self._next]
+        self._next = (self._next + 1) % len(self._batches)
+        if op is None:
+            op = 'pull' if self._rng.random_sample() < self._pull_ratio \
+                else 'push'
+        return op, keys
+
+
+class Recorder(object):
+    """Writes the batches of a trace in the trace file format."""
+
+    def __init__(self, trace, out, lock):
+        self._trace = trace
+        self._out = out
+        self._lock = lock
+
+    def next_batch(self):
+        op, keys = self._trace.next_batch()
+        line = op + ' ' + ' '.join(str(k) for k in keys) + '\n'
+        with self._lock:
+            self._out.write(line)
+        return op, keys
+
+
+def build_graph(ops, args):
+    ps = ops.get_ps_handle(key_dtype=tf.int64, value_dtype=tf.float32,
+                           shared_name='ps_loadgen',
+                           memory_budget_bytes=args.memory_budget,
+                           numa_node=args.numa_node,
+                           num_numa_threads=args.num_numa_threads,
+                           num_partitions=args.num_partitions)
+    keys = tf.placeholder(tf.int64, [None], name='keys')
+    values = tf.placeholder(tf.float32, [None], name='values')
+    default_value = tf.constant([0.0], dtype=tf.float32)
+    pull = ops.ps_pull(byte_ps_shard=ps, keys=keys,
+                       default_value=default_value,
+                       insert_on_miss=args.insert_on_miss,
+                       initializer='uniform', seed=args.seed)
+    push = ops.ps_push(byte_ps_shard=ps, keys=keys, values=values)
+    stats = ops.ps_shard_stats(byte_ps_shard=ps)
+    return {'keys': keys, 'values': values, 'pull': pull, 'push': push,
+            'stats': stats}
+
+
+class Stats(object):
+    def __init__(self):
+        self.latencies = {'pull': [], 'push': []}
+        self.keys = {'pull': 0, 'push': 0}
+        self.errors = {'pull': 0, 'push': 0}
+        # First message of every error type, per op.
+        self.error_messages = {'pull': {}, 'push': {}}
+
+    def merge(self, other):
+        for op in self.latencies:
+            self.latencies[op].extend(other.latencies[op])
+            self.keys[op] += other.keys[op]
+            self.errors[op] += other.errors[op]
+            for name, message in other.error_messages[op].items():
+                self.error_messages[op].setdefault(name, message)
+
+
+def run_session(sess, graph, trace, start, warmup_end, deadline, stats):
+    rng = np.random.RandomState()
+    now = start
+    while now < deadline:
+        op, keys = trace.next_batch()
+        feed = {graph['keys']: keys}
+        if op == 'push':
+            feed[graph['values']] = rng.random_sample(len(keys)).astype(
+                np.float32)
+        error = None
+        begin = timeit.default_timer()
+        try:
+            sess.run(graph[op], feed)
+        except tf.errors.OpError as e:
+            error = e
+        now = timeit.default_timer()
+        if begin < warmup_end:
+            continue
+        if error is not None:
+            stats.errors[op] += 1
+            stats.error_messages[op].setdefault(type(error).__name__,
+                                                error.message)
+        else:
+            stats.latencies[op].append(now - begin)
+            stats.keys[op] += len(keys)
+
+
+def sample_memory(sess, graph, start, deadline, interval, samples):
+    while True:
+        size, memory_used, bucket_count = sess.run(graph['stats'])
+        now = timeit.default_timer()
+        samples.append({'time': round(now - start, 3), 'size': int(size),
+                        'memory_used': int(memory_used),
+                        'bucket_count': int(bucket_count)})
+        if now >= deadline:
+            return
+        threading.Event().wait(min(interval, deadline - now))
+
+
+def summarize(stats, samples, elapsed, args):
+    report = {'config': vars(args), 'elapsed': elapsed, 'ops': {},
+              'memory': samples}
+    for op in ('pull', 'push'):
+        latencies = np.array(stats.latencies[op]) * 1e3
+        entry = {'requests': len(latencies), 'errors': stats.errors[op],
+                 'error_messages': stats.error_messages[op],
+                 'requests_per_sec': len(latencies) / elapsed,
+                 'keys_per_sec': stats.keys[op] / elapsed}
+        if len(latencies):
+            for p in _PERCENTILES:
+                entry['p%g_ms' % p] = float(np.percentile(latencies, p))
+            entry['max_ms'] = float(latencies.max())
+        report['ops'][op] = entry
+    return report
+
+
+def print_report(report, out):
+    print('measured %.1fs' % report['elapsed'], file=out)
+    header = ['op', 'req/s', 'keys/s', 'errors'] + \
+        ['p%g ms' % p for p in _PERCENTILES] + ['max ms']
+    print(('%-6s' + '%12s' * (len(header) - 1)) % tuple(header), file=out)
+    for op, entry in sorted(report['ops'].items()):
+        row = [entry['requests_per_sec'], entry['keys_per_sec'],
+               entry['errors']]
+        row += [entry.get('p%g_ms' % p, float('nan')) for p in _PERCENTILES]
+        row.append(entry.get('max_ms', float('nan')))
+        print(('%-6s' + '%12.1f' * 2 + '%12d' + '%12.3f' * (len(row) - 3))
+              % tuple([op] + row), file=out)
+    for op, entry in sorted(report['ops'].items()):
+        for name, message in sorted(entry['error_messages'].items()):
+            print('%s %s: %s' % (op, name, message), file=out)
+    print('%10s%14s%16s%14s' % ('time s', 'size', 'memory bytes', 'buckets'),
+          file=out)
+    for sample in report['memory']:
+        print('%10.1f%14d%16d%14d' % (sample['time'], sample['size'],
+                                      sample['memory_used'],
+                                      sample['bucket_count']), file=out)
+
+
+def main(argv):
+    args = parse_args(argv)
+    out = sys.stdout
+    if not args.native_stdout:
+        # The op library prints handle lifecycle messages to stdout; keep
+        # them out of the report. Per key logging is VLOG(2) and stays off
+        # unless TF_CPP_MIN_VLOG_LEVEL asks for it.
+        sys.stdout.flush()
+        out = os.fdopen(os.dup(1), 'w')
+        devnull = os.open(os.devnull, os.O_WRONLY)
+        os.dup2(devnull, 1)
+        os.close(devnull)
+
+    ops = load_ops(args.lib)
+    graph = build_graph(ops, args)
+
+    record_file = open(args.record, 'w') if args.record else None
+    record_lock = threading.Lock()
+    # The popularity table is shared, it is as large as the key space.
+    cdf = None if args.trace else ZipfTrace.popularity_cdf(args.num_keys,
+                                                           args.zipf)
+    traces = []
+    for i in range(args.sessions):
+        if args.trace:
+            trace = FileTrace(args, args.trace, i, args.sessions,
+                              args.seed + i)
+        else:
+            trace = ZipfTrace(args, cdf, args.seed + i)
+        if record_file:
+            trace = Recorder(trace, record_file, record_lock)
+        traces.append(trace)
+
+    with tf.Session() as sess:
+        start = timeit.default_timer()
+        warmup_end = start + args.warmup
+        deadline = warmup_end + args.duration
+        all_stats = [Stats() for _ in traces]
+        samples = []
+        threads = [threading.Thread(
+            target=run_session,
+            args=(sess, graph, trace, start, warmup_end, deadline, stats))
+            for trace, stats in zip(traces, all_stats)]
+        threads.append(threading.Thread(
+            target=sample_memory,
+            args=(sess, graph, start, deadline, args.sample_interval,
+                  samples)))
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = timeit.default_timer() - warmup_end
+
+    if record_file:
+        record_file.close()
+
+    stats = Stats()
+    for s in all_stats:
+        stats.merge(s)
+    report = summarize(stats, samples, elapsed, args)
+    print_report(report, out)
+    if args.report:
+        with open(args.report, 'w') as f:
+            json.dump(report, f, indent=2)
+    out.flush()
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
@@ -1,10 +1,10 @@
-import os
 import numpy as np
 import tensorflow as tf
 
+from tfop_lib import load_ops
+
 # https://www.tensorflow.org/guide/create_op?hl=zh-cn
-lib_path = os.path.join(os.path.dirname(os.path.dirname(__file__)), 'cmake-build-debug/libtfop.dylib')
-my_ops = tf.load_op_library(lib_path)
+my_ops = load_ops()
 
 print(dir(my_ops))
 
@@ -22,3 +22,176 @@ with tf.control_dependencies([no_op]):
 with tf.Session() as sess:
     ot = sess.run(out)
     print(ot)
+
+
+def test_remove_then_pull_returns_default():
+    with tf.Graph().as_default():
+        ps = my_ops.get_ps_handle(key_dtype=tf.int64, value_dtype=tf.float32,
+                                  shared_name='test_remove')
+        keys = tf.constant([1, 2, 3], dtype=tf.int64)
+        push = my_ops.ps_push(byte_ps_shard=ps, keys=keys,
+                              values=tf.constant([1.0, 2.0, 3.0]))
+        with tf.control_dependencies([push]):
+            remove = my_ops.ps_remove(byte_ps_shard=ps, keys=keys[:2])
+        with tf.control_dependencies([remove]):
+            pull = my_ops.ps_pull(byte_ps_shard=ps, keys=keys,
+                                  default_value=tf.constant([-1.0]))
+        with tf.Session() as sess:
+            np.testing.assert_allclose(sess.run(pull), [-1.0, -1.0, 3.0])
+
+
+def test_compact_shrinks_table():
+    num_keys = 10000
+    with tf.Graph().as_default():
+        ps = my_ops.get_ps_handle(key_dtype=tf.int64, value_dtype=tf.float32,
+                                  shared_name='test_compact')
+        keys = tf.range(num_keys, dtype=tf.int64)
+        push = my_ops.ps_push(byte_ps_shard=ps, keys=keys,
+                              values=tf.ones([num_keys]))
+        kept = num_keys // 100
+        remove = my_ops.ps_remove(byte_ps_shard=ps, keys=keys[kept:])
+        compact = my_ops.ps_compact(byte_ps_shard=ps)
+        size, _, bucket_count = my_ops.ps_shard_stats(byte_ps_shard=ps)
+        pull = my_ops.ps_pull(byte_ps_shard=ps, keys=keys[:kept],
+                              default_value=tf.constant([0.0]))
+        with tf.Session() as sess:
+            sess.run(push)
+            sess.run(remove)
+            buckets_before = sess.run(bucket_count)
+            reclaimed_bytes = sess.run(compact)
+            size_after, buckets_after = sess.run([size, bucket_count])
+            assert reclaimed_bytes > 0, reclaimed_bytes
+            assert buckets_after < buckets_before, (buckets_before,
+                                                    buckets_after)
+            assert size_after == kept, size_after
+            np.testing.assert_allclose(sess.run(pull), 1.0)
+
+
+def test_pull_combine_matches_segment_ops():
+    keys = [3, 1, 4, 1, 5, 9, 2, 6]  # 9 and 6 are never pushed.
+    segment_ids = [0, 0, 0, 1, 1, 2, 2, 2]
+    with tf.Graph().as_default():
+        ps = my_ops.get_ps_handle(key_dtype=tf.int64, value_dtype=tf.float32,
+                                  shared_name='test_combine')
+        push = my_ops.ps_push(
+            byte_ps_shard=ps, keys=tf.constant([1, 2, 3, 4, 5], tf.int64),
+            values=tf.constant([0.5, -1.0, 2.0, 4.0, 8.0]))
+        id_tensor = tf.constant(keys, dtype=tf.int64)
+        segment_tensor = tf.constant(segment_ids, dtype=tf.int64)
+        default_value = tf.constant([0.25])
+        with tf.control_dependencies([push]):
+            pulled = my_ops.ps_pull(byte_ps_shard=ps, keys=id_tensor,
+                                    default_value=default_value)
+        indices = tf.range(len(keys))
+        expected = {
+            'sum': tf.sparse.segment_sum(pulled, indices, segment_tensor),
+            'mean': tf.sparse.segment_mean(pulled, indices, segment_tensor),
+            'sqrtn': tf.sparse.segment_sqrt_n(pulled, indices, segment_tensor),
+        }
+        combined = {}
+        for combiner in expected:
+            with tf.control_dependencies([push]):
+                combined[combiner] = my_ops.ps_pull_combine(
+                    byte_ps_shard=ps, keys=id_tensor,
+                    segment_ids=segment_tensor, weights=tf.zeros([0]),
+                    num_segments=tf.constant(3, tf.int64),
+                    default_value=default_value, combiner=combiner)
+        with tf.Session() as sess:
+            expected, combined = sess.run([expected, combined])
+        for combiner in expected:
+            np.testing.assert_allclose(combined[combiner], expected[combiner],
+                                       rtol=1e-6, err_msg=combiner)
+
+
+def test_insert_on_miss_is_deterministic_across_shards():
+    with tf.Graph().as_default():
+        keys = tf.constant([11, 22, 33, 44], dtype=tf.int64)
+        pulls = []
+        for name in ('test_init_a', 'test_init_b'):
+            ps = my_ops.get_ps_handle(key_dtype=tf.int64,
+                                      value_dtype=tf.float32, shared_name=name)
+            pulls.append(my_ops.ps_pull(
+                byte_ps_shard=ps, keys=keys, default_value=tf.constant([0.0]),
+                insert_on_miss=True, initializer='uniform', seed=7))
+        with tf.Session() as sess:
+            a, b = sess.run(pulls)
+            again = sess.run(pulls[0])
+    np.testing.assert_array_equal(a, b)
+    np.testing.assert_array_equal(a, again)
+    assert np.all(a != 0.0), a
+    assert np.all(np.abs(a) <= 0.05), a
+
+def test_memory_budget():
+    num_keys = 3000
+    with tf.Graph().as_default():
+        # One partition, so a rejected batch leaves no partition updated.
+        ps = my_ops.get_ps_handle(key_dtype=tf.int64, value_dtype=tf.float32,
+                                  shared_name='test_budget',
+                                  memory_budget_bytes=200 << 10,
+                                  num_partitions=1)
+        old_keys = tf.range(num_keys, dtype=tf.int64)
+        new_keys = tf.range(num_keys, 2 * num_keys, dtype=tf.int64)
+        push_old = my_ops.ps_push(byte_ps_shard=ps, keys=old_keys,
+                                  values=tf.ones([num_keys]))
+        push_new = my_ops.ps_push(byte_ps_shard=ps, keys=new_keys,
+                                  values=tf.ones([num_keys]))
+        remove_old = my_ops.ps_remove(byte_ps_shard=ps, keys=old_keys)
+        compact = my_ops.ps_compact(byte_ps_shard=ps)
+        size, memory_used, _ = my_ops.ps_shard_stats(byte_ps_shard=ps)
+        with tf.Session() as sess:
+            empty_memory = sess.run(memory_used)
+            sess.run(push_old)
+            full_memory = sess.run(memory_used)
+            assert full_memory > empty_memory, (empty_memory, full_memory)
+            try:
+                sess.run(push_new)
+                raise AssertionError('push over the memory budget succeeded')
+            except tf.errors.ResourceExhaustedError:
+                pass
+            assert sess.run(size) == num_keys
+            assert sess.run(memory_used) == full_memory
+
+            sess.run(remove_old)
+            removed_memory = sess.run(memory_used)
+            assert removed_memory < full_memory, (full_memory, removed_memory)
+            sess.run(compact)
+            compacted_memory = sess.run(memory_used)
+            assert compacted_memory <= removed_memory, (removed_memory,
+                                                        compacted_memory)
+
+            sess.run(push_new)
+            assert sess.run(size) == num_keys
+            assert sess.run(memory_used) <= 200 << 10
+
+def test_numa_pool_smoke():
+    # Runs on the worker pool and, where TF has NUMA support, on a node
+    # bound arena; other builds warn and fall back to the heap.
+    with tf.Graph().as_default():
+        ps = my_ops.get_ps_handle(key_dtype=tf.int64, value_dtype=tf.float32,
+                                  shared_name='test_numa', numa_node='0',
+                                  num_numa_threads=2, num_partitions=1)
+        keys = tf.range(1000, dtype=tf.int64)
+        push = my_ops.ps_push(byte_ps_shard=ps, keys=keys,
+                              values=tf.cast(keys, tf.float32))
+        pull = my_ops.ps_pull(byte_ps_shard=ps, keys=keys,
+                              default_value=tf.constant([-1.0]))
+        remove = my_ops.ps_remove(byte_ps_shard=ps, keys=keys[10:])
+        compact = my_ops.ps_compact(byte_ps_shard=ps)
+        size, _, _ = my_ops.ps_shard_stats(byte_ps_shard=ps)
+        with tf.Session() as sess:
+            sess.run(push)
+            np.testing.assert_allclose(sess.run(pull), np.arange(1000))
+            sess.run(remove)
+            sess.run(compact)
+            assert sess.run(size) == 10
+            expected = np.where(np.arange(1000) < 10, np.arange(1000), -1.0)
+            np.testing.assert_allclose(sess.run(pull), expected)
+
+
+test_remove_then_pull_returns_default()
+test_compact_shrinks_table()
+test_pull_combine_matches_segment_ops()
+test_insert_on_miss_is_deterministic_across_shards()
+test_memory_budget()
+test_numa_pool_smoke()
+print('all tests passed')
@@ -0,0 +1,29 @@
+import os
+
+import tensorflow as tf
+
+_ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+_BUILD_DIRS = ['build', 'cmake-build-release', 'cmake-build-debug']
+_LIB_NAMES = ['libtfop.so', 'libtfop.dylib']
+
+
+def find_library():
+    """Returns the path of the built op library.
+
+    $TFOP_LIB wins, otherwise the usual CMake build directories under the
+    repository root are searched.
+    """
+    path = os.environ.get('TFOP_LIB')
+    if path:
+        return path
+    for build_dir in _BUILD_DIRS:
+        for name in _LIB_NAMES:
+            path = os.path.join(_ROOT, build_dir, name)
+            if os.path.exists(path):
+                return path
+    raise IOError('libtfop not found under %s, build it or set TFOP_LIB'
+                  % ', '.join(_BUILD_DIRS))
+
+
+def load_ops(lib_path=None):
+    return tf.load_op_library(lib_path or find_library())
@@ -0,0 +1,40 @@
+#include "ps_initializer.h"
+
+namespace tensorflow {
+namespace byteps {
+
+constexpr float PSInitializer::kTruncateValue;
+
+Status PSInitializer::FromAttrs(OpKernelConstruction *ctx,
+                                PSInitializer *init) {
+  string type;
+  TF_RETURN_IF_ERROR(ctx->GetAttr("initializer", &type));
+  if (type == "zeros") {
+    init->type = InitializerType::kZeros;
+  } else if (type == "uniform") {
+    init->type = InitializerType::kUniform;
+  } else if (type == "truncated_normal") {
+    init->type = InitializerType::kTruncatedNormal;
+  } else {
+    return errors::InvalidArgument("Unknown initializer: ", type);
+  }
+
+  TF_RETURN_IF_ERROR(ctx->GetAttr("init_minval", &init->minval));
+  TF_RETURN_IF_ERROR(ctx->GetAttr("init_maxval", &init->maxval));
+  TF_RETURN_IF_ERROR(ctx->GetAttr("init_mean", &init->mean));
+  TF_RETURN_IF_ERROR(ctx->GetAttr("init_stddev", &init->stddev));
+  TF_RETURN_IF_ERROR(ctx->GetAttr("seed", &init->seed));
+
+  if (init->minval >= init->maxval) {
+    return errors::InvalidArgument("init_minval must be < init_maxval, got ",
+                                   init->minval, " and ", init->maxval);
+  }
+  if (init->stddev < 0) {
+    return errors::InvalidArgument("init_stddev must be >= 0, got ",
+                                   init->stddev);
+  }
+  return Status::OK();
+}
+
+} // namespace byteps
+} // namespace tensorflow
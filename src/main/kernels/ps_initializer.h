@@ -0,0 +1,82 @@
+#ifndef TFOP_SRC_MAIN_KERNELS_PS_INITIALIZER_H_
+#define TFOP_SRC_MAIN_KERNELS_PS_INITIALIZER_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include "tensorflow/core/framework/op_kernel.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/lib/random/philox_random.h"
+#include "tensorflow/core/lib/random/random_distributions.h"
+
+namespace tensorflow {
+namespace byteps {
+
+enum class InitializerType { kZeros, kUniform, kTruncatedNormal };
+
+// Produces the initial value of keys created by PSPull in insert-on-miss
+// mode. The value of a key only depends on the key and `seed`, so every
+// worker and every retry creates the same entry.
+struct PSInitializer {
+  InitializerType type = InitializerType::kZeros;
+  float minval = -0.05f;
+  float maxval = 0.05f;
+  float mean = 0.0f;
+  float stddev = 0.05f;
+  int64 seed = 0;
+
+  // Reads the `initializer`, `init_*` and `seed` attrs of `ctx`.
+  static Status FromAttrs(OpKernelConstruction *ctx, PSInitializer *init);
+
+  // Truncation bound of TruncatedNormalDistribution, in standard deviations.
+  static constexpr float kTruncateValue = 2.0f;
+
+  // Fills values[0, n) with the initial values of keys[0, n).
+  template <class K, class V>
+  void Generate(const K *keys, int64 n, V *values) const {
+    if (type == InitializerType::kZeros) {
+      std::fill(values, values + n, static_cast<V>(0));
+      return;
+    }
+
+    const uint64 seed_bits = static_cast<uint64>(seed);
+    for (int64 i = 0; i < n; ++i) {
+      // Each key drives its own Philox stream so the result does not depend
+      // on which other keys missed in the same batch, or in which order.
+      // Packing several keys into the four lanes of one block would tie a
+      // value to its neighbours, so a scalar uses one lane of its block and
+      // only that lane is converted.
+      const uint64 key_hash =
+          Hash64(reinterpret_cast<const char *>(&keys[i]), sizeof(K));
+      random::PhiloxRandom gen(key_hash, seed_bits);
+      if (type == InitializerType::kUniform) {
+        const float u = random::Uint32ToFloat(gen()[0]);
+        values[i] = static_cast<V>(minval + (maxval - minval) * u);
+      } else {
+        // The first sample TruncatedNormalDistribution would accept, without
+        // drawing the three more it returns.
+        random::SingleSampleAdapter<random::PhiloxRandom> single(&gen);
+        float z;
+        while (true) {
+          const uint32 x0 = single();
+          const uint32 x1 = single();
+          float z1;
+          random::BoxMullerFloat(x0, x1, &z, &z1);
+          if (std::abs(z) < kTruncateValue) {
+            break;
+          }
+          if (std::abs(z1) < kTruncateValue) {
+            z = z1;
+            break;
+          }
+        }
+        values[i] = static_cast<V>(mean + stddev * z);
+      }
+    }
+  }
+};
+
+} // namespace byteps
+} // namespace tensorflow
+#endif // TFOP_SRC_MAIN_KERNELS_PS_INITIALIZER_H_
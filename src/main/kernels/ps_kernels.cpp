@@ -27,11 +27,33 @@ public:
         expected_input_0_(ctx->input_type(0) == DT_RESOURCE ? DT_RESOURCE
                                                             : DT_STRING_REF) {}
 
+  // Runs ComputeWithShard on the shard's NUMA pinned worker pool when it has
+  // one, and inline otherwise.
+  void ComputeAsync(OpKernelContext *ctx, DoneCallback done) final {
+    PSShard *shard;
+    OP_REQUIRES_OK_ASYNC(ctx, GetPSShard(ctx, &shard), done);
+
+    thread::ThreadPool *pool = shard->worker_pool();
+    if (pool == nullptr) {
+      core::ScopedUnref unref_me(shard);
+      ComputeWithShard(ctx, shard);
+      done();
+      return;
+    }
+    pool->Schedule([this, ctx, shard, done]() {
+      core::ScopedUnref unref_me(shard);
+      ComputeWithShard(ctx, shard);
+      done();
+    });
+  }
+
 protected:
   static Status GetPSShard(OpKernelContext *ctx, PSShard **shard) {
     return byteps::GetPSShard("byte_ps_shard", ctx, shard);
   }
 
+  virtual void ComputeWithShard(OpKernelContext *ctx, PSShard *shard) = 0;
+
   // Input 0 could be a STRING_REF or a RESOURCE
   const DataType expected_input_0_;
 
@@ -66,15 +88,29 @@ public:
 
 REGISTER_KERNEL_BUILDER(Name("PSAddMeta").Device(DEVICE_CPU), PSAddMetaOp);
 
-class PSPullOp : public ShardOpBaseKernel {
+class PSPullOp : public AsyncShardOpBaseKernel {
 public:
-  explicit PSPullOp(OpKernelConstruction *ctx) : ShardOpBaseKernel(ctx) {}
-
-  void Compute(OpKernelContext *ctx) override {
-    PSShard *shard;
-    OP_REQUIRES_OK(ctx, GetPSShard(ctx, &shard));
-    core::ScopedUnref unref_me(shard);
+  explicit PSPullOp(OpKernelConstruction *ctx) : AsyncShardOpBaseKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("insert_on_miss", &insert_on_miss_));
+    if (insert_on_miss_) {
+      OP_REQUIRES_OK(ctx,
+                     byteps::PSInitializer::FromAttrs(ctx, &initializer_));
+
+      // Random values in the default +-0.05 range would all truncate to 0.
+      DataType value_dtype;
+      OP_REQUIRES_OK(ctx, ctx->GetAttr("Tout", &value_dtype));
+      OP_REQUIRES(ctx,
+                  !DataTypeIsInteger(value_dtype) ||
+                      initializer_.type == byteps::InitializerType::kZeros,
+                  errors::InvalidArgument(
+                      "Only the zeros initializer supports integral values, "
+                      "got value type ",
+                      DataTypeString(value_dtype)));
+    }
+  }
 
+protected:
+  void ComputeWithShard(OpKernelContext *ctx, PSShard *shard) override {
     // DataTypeVector expected_inputs = {expected_input_0_, shard->key_dtype(),
     //                                  shard->value_dtype()};
     // OP_REQUIRES_OK(ctx, ctx->MatchSignature(expected_inputs, {}));
@@ -89,22 +125,103 @@ public:
     Tensor *out;
     OP_REQUIRES_OK(ctx, ctx->allocate_output("values", output_shape, &out));
 
-    OP_REQUIRES_OK(ctx, shard->Find(ctx, key, out, default_value));
-    std::cout << "PSPullOp: compute " << std::endl;
+    if (insert_on_miss_) {
+      int64 memory_used_before = 0;
+      if (ctx->track_allocations()) {
+        memory_used_before = shard->MemoryUsed();
+      }
+
+      OP_REQUIRES_OK(ctx, shard->FindOrInsert(ctx, key, out, initializer_));
+      if (ctx->track_allocations()) {
+        ctx->record_persistent_memory_allocation(shard->MemoryUsed() -
+                                                 memory_used_before);
+      }
+    } else {
+      OP_REQUIRES_OK(ctx, shard->Find(ctx, key, out, default_value));
+    }
+    VLOG(1) << "PSPullOp: compute";
   }
+
+private:
+  bool insert_on_miss_;
+  byteps::PSInitializer initializer_;
 };
 
 REGISTER_KERNEL_BUILDER(Name("PSPull").Device(DEVICE_CPU), PSPullOp);
 
-class PSPushOp : public ShardOpBaseKernel {
+class PSPullCombineOp : public AsyncShardOpBaseKernel {
 public:
-  explicit PSPushOp(OpKernelConstruction *ctx) : ShardOpBaseKernel(ctx) {}
+  explicit PSPullCombineOp(OpKernelConstruction *ctx)
+      : AsyncShardOpBaseKernel(ctx) {
+    string combiner;
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("combiner", &combiner));
+    OP_REQUIRES_OK(ctx, byteps::ParseCombiner(combiner, &combiner_));
+  }
 
-  void Compute(OpKernelContext *ctx) override {
-    PSShard *shard;
-    OP_REQUIRES_OK(ctx, GetPSShard(ctx, &shard));
-    core::ScopedUnref unref_me(shard);
+protected:
+  void ComputeWithShard(OpKernelContext *ctx, PSShard *shard) override {
+    const Tensor &keys = ctx->input(1);
+    const Tensor &segment_ids = ctx->input(2);
+    const Tensor &weights = ctx->input(3);
+    const Tensor &num_segments = ctx->input(4);
+    const Tensor &default_value = ctx->input(5);
+
+    OP_REQUIRES(ctx,
+                keys.dtype() == shard->key_dtype() &&
+                    weights.dtype() == shard->value_dtype() &&
+                    default_value.dtype() == shard->value_dtype(),
+                errors::InvalidArgument(
+                    "Expected keys of type ", shard->key_dtype(),
+                    " and weights/default_value of type ",
+                    shard->value_dtype()));
+    OP_REQUIRES(ctx, TensorShapeUtils::IsVector(keys.shape()),
+                errors::InvalidArgument("keys must be a vector, got shape ",
+                                        keys.shape().DebugString()));
+    OP_REQUIRES(ctx, segment_ids.shape() == keys.shape(),
+                errors::InvalidArgument(
+                    "segment_ids shape ", segment_ids.shape().DebugString(),
+                    " does not match keys shape ", keys.shape().DebugString()));
+    OP_REQUIRES(ctx,
+                weights.NumElements() == 0 || weights.shape() == keys.shape(),
+                errors::InvalidArgument(
+                    "weights must be empty or match keys shape ",
+                    keys.shape().DebugString(), ", got ",
+                    weights.shape().DebugString()));
+    OP_REQUIRES(ctx, TensorShapeUtils::IsScalar(num_segments.shape()),
+                errors::InvalidArgument("num_segments must be a scalar, got ",
+                                        num_segments.shape().DebugString()));
+    OP_REQUIRES(ctx, default_value.NumElements() == 1,
+                errors::InvalidArgument(
+                    "default_value must have exactly one element, got shape ",
+                    default_value.shape().DebugString()));
+
+    const int64 output_rows = num_segments.scalar<int64>()();
+    OP_REQUIRES(ctx, output_rows >= 0,
+                errors::InvalidArgument("num_segments must be >= 0, got ",
+                                        output_rows));
+
+    TensorShape output_shape({output_rows});
+    output_shape.AppendShape(shard->value_shape());
+    Tensor *out;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output("values", output_shape, &out));
+
+    OP_REQUIRES_OK(ctx, shard->FindAndCombine(ctx, keys, segment_ids, weights,
+                                              default_value, combiner_, out));
+  }
+
+private:
+  byteps::Combiner combiner_;
+};
 
+REGISTER_KERNEL_BUILDER(Name("PSPullCombine").Device(DEVICE_CPU),
+                        PSPullCombineOp);
+
+class PSPushOp : public AsyncShardOpBaseKernel {
+public:
+  explicit PSPushOp(OpKernelConstruction *ctx) : AsyncShardOpBaseKernel(ctx) {}
+
+protected:
+  void ComputeWithShard(OpKernelContext *ctx, PSShard *shard) override {
     //    DataTypeVector expected_inputs = {expected_input_0_,
     //    shard->key_dtype(), shard->value_dtype()};
     //    OP_REQUIRES_OK(ctx, ctx->MatchSignature(expected_inputs, {}));
@@ -124,12 +241,98 @@ public:
                                                memory_used_before);
     }
 
-    std::cout << "PSPushOp: compute " << std::endl;
+    VLOG(1) << "PSPushOp: compute";
   }
 };
 
 REGISTER_KERNEL_BUILDER(Name("PSPush").Device(DEVICE_CPU), PSPushOp);
 
+class PSRemoveOp : public AsyncShardOpBaseKernel {
+public:
+  explicit PSRemoveOp(OpKernelConstruction *ctx)
+      : AsyncShardOpBaseKernel(ctx) {}
+
+protected:
+  void ComputeWithShard(OpKernelContext *ctx, PSShard *shard) override {
+    const Tensor &keys = ctx->input(1);
+    OP_REQUIRES_OK(ctx, shard->CheckKeyTensorForRemove(keys));
+
+    int64 memory_used_before = 0;
+    if (ctx->track_allocations()) {
+      memory_used_before = shard->MemoryUsed();
+    }
+
+    OP_REQUIRES_OK(ctx, shard->Remove(ctx, keys));
+    if (ctx->track_allocations()) {
+      ctx->record_persistent_memory_allocation(shard->MemoryUsed() -
+                                               memory_used_before);
+    }
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("PSRemove").Device(DEVICE_CPU), PSRemoveOp);
+
+class PSCompactOp : public ShardOpBaseKernel {
+public:
+  explicit PSCompactOp(OpKernelConstruction *ctx) : ShardOpBaseKernel(ctx) {
+    OP_REQUIRES_OK(ctx, ctx->GetAttr("min_load_factor", &min_load_factor_));
+    OP_REQUIRES(ctx, min_load_factor_ >= 0,
+                errors::InvalidArgument("min_load_factor must be >= 0, got ",
+                                        min_load_factor_));
+  }
+
+  void Compute(OpKernelContext *ctx) override {
+    PSShard *shard;
+    OP_REQUIRES_OK(ctx, GetPSShard(ctx, &shard));
+    core::ScopedUnref unref_me(shard);
+
+    Tensor *out;
+    OP_REQUIRES_OK(
+        ctx, ctx->allocate_output("reclaimed_bytes", TensorShape({}), &out));
+
+    int64 reclaimed_bytes = 0;
+    OP_REQUIRES_OK(ctx,
+                   shard->Compact(ctx, min_load_factor_, &reclaimed_bytes));
+    out->scalar<int64>()() = reclaimed_bytes;
+    if (ctx->track_allocations()) {
+      ctx->record_persistent_memory_allocation(-reclaimed_bytes);
+    }
+  }
+
+private:
+  float min_load_factor_;
+};
+
+REGISTER_KERNEL_BUILDER(Name("PSCompact").Device(DEVICE_CPU), PSCompactOp);
+
+class PSShardStatsOp : public ShardOpBaseKernel {
+public:
+  explicit PSShardStatsOp(OpKernelConstruction *ctx)
+      : ShardOpBaseKernel(ctx) {}
+
+  void Compute(OpKernelContext *ctx) override {
+    PSShard *shard;
+    OP_REQUIRES_OK(ctx, GetPSShard(ctx, &shard));
+    core::ScopedUnref unref_me(shard);
+
+    Tensor *size;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output("size", TensorShape({}), &size));
+    Tensor *memory_used;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output("memory_used", TensorShape({}),
+                                             &memory_used));
+    Tensor *bucket_count;
+    OP_REQUIRES_OK(ctx, ctx->allocate_output("bucket_count", TensorShape({}),
+                                             &bucket_count));
+    size->scalar<int64>()() = static_cast<int64>(shard->size());
+    memory_used->scalar<int64>()() = shard->MemoryUsed();
+    bucket_count->scalar<int64>()() =
+        static_cast<int64>(shard->bucket_count());
+  }
+};
+
+REGISTER_KERNEL_BUILDER(Name("PSShardStats").Device(DEVICE_CPU),
+                        PSShardStatsOp);
+
 class PSLoadOp : public ShardOpBaseKernel {
 public:
   explicit PSLoadOp(OpKernelConstruction *ctx) : ShardOpBaseKernel(ctx) {}
@@ -90,7 +90,7 @@ public:
       }
       ctx->set_output_ref(0, &mu_, shard_handle_.AccessTensor(ctx));
     }
-    std::cout << "GetPSHandleOp: compute" << std::endl;
+    VLOG(1) << "GetPSHandleOp: compute";
     is_shard_handle_set_ = true;
   }
 
@@ -0,0 +1,224 @@
+#include "ps_numa.h"
+
+#include <algorithm>
+#include <new>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "tensorflow/core/lib/strings/numbers.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/mem.h"
+
+namespace tensorflow {
+namespace byteps {
+
+namespace {
+
+size_t RoundUp(size_t bytes, size_t multiple) {
+  return (bytes + multiple - 1) / multiple * multiple;
+}
+
+#ifdef __GLIBC__
+// glibc serves a request from a chunk of 16 byte multiples, at least 32
+// bytes, that includes a size_t header. From kMmapMinBytes on, the request
+// may be mapped instead, taking whole pages and one more header word.
+constexpr size_t kMallocMinChunkBytes = 32;
+constexpr size_t kMmapMinBytes = 128 << 10;
+
+size_t MallocChunkBytes(size_t bytes) {
+  return std::max(kMallocMinChunkBytes, RoundUp(bytes + sizeof(size_t), 16));
+}
+#endif
+
+} // namespace
+
+constexpr int NUMAPlacement::kInterleave;
+constexpr size_t NUMAArena::kPageBytes;
+constexpr size_t NUMAArena::kSlabBytes;
+constexpr size_t NUMAArena::kMaxSmallBytes;
+constexpr size_t NUMAArena::kSmallAlignment;
+
+Status NUMAPlacement::Parse(const string &spec) {
+  if (spec.empty()) {
+    node_ = port::kNUMANoAffinity;
+    return Status::OK();
+  }
+  int32 node = kInterleave;
+  if (spec != "interleave" &&
+      (!strings::safe_strto32(spec, &node) || node < 0)) {
+    return errors::InvalidArgument(
+        "numa_node must be '', 'interleave' or a node index, got '", spec,
+        "'");
+  }
+  if (!port::NUMAEnabled()) {
+    // Without hwloc TF sees a single node and cannot bind memory or threads.
+    LOG(WARNING) << "Ignoring numa_node '" << spec
+                 << "': this TensorFlow build has no NUMA support, so the "
+                    "table memory and the num_numa_threads pool stay "
+                    "unpinned.";
+    node_ = port::kNUMANoAffinity;
+    return Status::OK();
+  }
+  if (node >= port::NUMANumNodes()) {
+    return errors::InvalidArgument(
+        "numa_node ", node, " is out of range, TensorFlow's NUMA support sees ",
+        port::NUMANumNodes(), " node(s) on this host");
+  }
+  node_ = node;
+  return Status::OK();
+}
+
+NUMAArena::NUMAArena(const NUMAPlacement *placement)
+    : placement_(placement),
+      free_lists_(kMaxSmallBytes / kSmallAlignment + 1, nullptr),
+      free_counts_(free_lists_.size(), 0) {}
+
+NUMAArena::~NUMAArena() {
+  for (void *slab : slabs_) {
+    port::NUMAFree(slab, kSlabBytes);
+  }
+}
+
+void *NUMAArena::Allocate(size_t bytes, size_t alignment) {
+  if (placement_->has_node() && IsSmall(bytes, alignment)) {
+    const size_t size = RoundUp(bytes, kSmallAlignment);
+    FreeBlock *&head = free_lists_[size / kSmallAlignment];
+    if (head != nullptr) {
+      FreeBlock *block = head;
+      head = block->next;
+      --free_counts_[size / kSmallAlignment];
+      return block;
+    }
+    if (static_cast<size_t>(slab_end_ - slab_cursor_) < size) {
+      void *slab = port::NUMAMalloc(placement_->NextNode(), kSlabBytes,
+                                    static_cast<int>(kPageBytes));
+      if (slab == nullptr) {
+        throw std::bad_alloc();
+      }
+      slabs_.push_back(slab);
+      bytes_reserved_ += kSlabBytes;
+      slab_cursor_ = static_cast<char *>(slab);
+      slab_end_ = slab_cursor_ + kSlabBytes;
+    }
+    void *ptr = slab_cursor_;
+    slab_cursor_ += size;
+    return ptr;
+  }
+
+  void *ptr;
+  if (!placement_->has_node()) {
+    // posix_memalign rejects alignments below sizeof(void *).
+    ptr = port::AlignedMalloc(
+        bytes, static_cast<int>(std::max(alignment, sizeof(void *))));
+  } else {
+    ptr = port::NUMAMalloc(placement_->NextNode(), bytes,
+                           static_cast<int>(std::max(alignment, kPageBytes)));
+  }
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  bytes_reserved_ += BlockBytes(ptr, bytes);
+  return ptr;
+}
+
+void NUMAArena::Deallocate(void *ptr, size_t bytes, size_t alignment) {
+  if (!placement_->has_node()) {
+    bytes_reserved_ -= BlockBytes(ptr, bytes);
+    port::AlignedFree(ptr);
+  } else if (!IsSmall(bytes, alignment)) {
+    bytes_reserved_ -= BlockBytes(ptr, bytes);
+    port::NUMAFree(ptr, bytes);
+  } else {
+    const size_t size_class = RoundUp(bytes, kSmallAlignment) / kSmallAlignment;
+    FreeBlock *block = static_cast<FreeBlock *>(ptr);
+    block->next = free_lists_[size_class];
+    free_lists_[size_class] = block;
+    ++free_counts_[size_class];
+  }
+}
+
+size_t NUMAArena::BlockBytes(void *ptr, size_t bytes) const {
+  if (placement_->has_node()) {
+    return RoundUp(bytes, kPageBytes);
+  }
+#ifdef __GLIBC__
+  // Small blocks count the chunk their size maps to, so the budget
+  // projection matches them exactly; the few bytes of a larger free chunk
+  // malloc may hand out instead are not counted. Large ones, which may be
+  // mapped, count the real chunk, header included.
+  if (bytes < kMmapMinBytes) {
+    return MallocChunkBytes(bytes);
+  }
+  return malloc_usable_size(ptr) + sizeof(size_t);
+#else
+  return bytes;
+#endif
+}
+
+void NUMAArena::Projection::Allocate(size_t bytes, size_t alignment,
+                                     size_t count) {
+  if (!arena_->placement_->has_node()) {
+#ifdef __GLIBC__
+    // A mapped chunk is the largest a request can take.
+    const size_t chunk = MallocChunkBytes(bytes);
+    block_bytes_ += static_cast<int64>(
+        count * (bytes < kMmapMinBytes
+                     ? chunk
+                     : RoundUp(chunk + sizeof(size_t), kPageBytes)));
+#else
+    block_bytes_ += static_cast<int64>(count * bytes);
+#endif
+    return;
+  }
+  if (!arena_->IsSmall(bytes, alignment)) {
+    block_bytes_ += static_cast<int64>(count * RoundUp(bytes, kPageBytes));
+    return;
+  }
+  const size_t size = RoundUp(bytes, kSmallAlignment);
+  const size_t size_class = size / kSmallAlignment;
+  int64 &delta = free_delta_[size_class];
+  const int64 available =
+      static_cast<int64>(arena_->free_counts_[size_class]) + delta;
+  const int64 reused = std::min(available, static_cast<int64>(count));
+  delta -= reused;
+  slab_bytes_ += (static_cast<int64>(count) - reused) * size;
+}
+
+void NUMAArena::Projection::Deallocate(size_t bytes, size_t alignment,
+                                       size_t count) {
+  if (!arena_->placement_->has_node()) {
+#ifdef __GLIBC__
+    // A heap chunk is the smallest a request can have taken.
+    block_bytes_ -= static_cast<int64>(count * MallocChunkBytes(bytes));
+#else
+    block_bytes_ -= static_cast<int64>(count * bytes);
+#endif
+    return;
+  }
+  if (!arena_->IsSmall(bytes, alignment)) {
+    block_bytes_ -= static_cast<int64>(count * RoundUp(bytes, kPageBytes));
+    return;
+  }
+  free_delta_[RoundUp(bytes, kSmallAlignment) / kSmallAlignment] +=
+      static_cast<int64>(count);
+}
+
+int64 NUMAArena::Projection::growth() const {
+  // Space left in the current slab is only counted past the largest block
+  // that might not fit at its end, and the same goes for every new slab.
+  const int64 left = arena_->slab_end_ - arena_->slab_cursor_;
+  const int64 usable_left =
+      std::max<int64>(0, left - static_cast<int64>(kMaxSmallBytes));
+  int64 growth = block_bytes_;
+  if (slab_bytes_ > usable_left) {
+    const int64 usable_per_slab = kSlabBytes - kMaxSmallBytes;
+    const int64 slabs =
+        (slab_bytes_ - usable_left + usable_per_slab - 1) / usable_per_slab;
+    growth += slabs * static_cast<int64>(kSlabBytes);
+  }
+  return growth;
+}
+
+} // namespace byteps
+} // namespace tensorflow
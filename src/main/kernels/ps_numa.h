@@ -0,0 +1,175 @@
+#ifndef TFOP_SRC_MAIN_KERNELS_PS_NUMA_H_
+#define TFOP_SRC_MAIN_KERNELS_PS_NUMA_H_
+
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/numa.h"
+#include "tensorflow/core/platform/types.h"
+
+namespace tensorflow {
+namespace byteps {
+
+// Where a shard keeps its table memory, parsed from the `numa_node` attr of
+// GetPSHandle: "" for no preference, "interleave" to spread allocations
+// round-robin over all nodes, or the index of a single node. A TF build
+// without NUMA support logs a warning and falls back to no preference.
+class NUMAPlacement {
+public:
+  static constexpr int kInterleave = -2;
+
+  NUMAPlacement() = default;
+
+  Status Parse(const string &spec);
+
+  // Whether memory is bound to a node, either a single one or interleaved.
+  bool has_node() const { return node_ != port::kNUMANoAffinity; }
+
+  // Node of a single node placement, port::kNUMANoAffinity otherwise.
+  int node() const {
+    return node_ == kInterleave ? port::kNUMANoAffinity : node_;
+  }
+
+  bool interleave() const { return node_ == kInterleave; }
+
+  // Node the next allocation should come from. Only valid if has_node().
+  int NextNode() const {
+    if (node_ != kInterleave) {
+      return node_;
+    }
+    const uint32 next = next_node_.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<int>(next % static_cast<uint32>(port::NUMANumNodes()));
+  }
+
+private:
+  int node_ = port::kNUMANoAffinity;
+  mutable std::atomic<uint32> next_node_{0};
+
+  TF_DISALLOW_COPY_AND_ASSIGN(NUMAPlacement);
+};
+
+// Memory of one partition's table. Without a node the arena is a thin
+// wrapper over port::AlignedMalloc. With one, node bound memory is mapped
+// page by page, so blocks up to kMaxSmallBytes (hash nodes, small bucket
+// arrays) are carved from kSlabBytes slabs and recycled through per size
+// free lists; only larger blocks are bound one by one. Slabs are returned
+// to the system when the arena is destroyed.
+//
+// Not thread safe: the owning partition's lock serializes every use.
+class NUMAArena {
+public:
+  explicit NUMAArena(const NUMAPlacement *placement);
+  ~NUMAArena();
+
+  void *Allocate(size_t bytes, size_t alignment);
+
+  // `bytes` and `alignment` must match the Allocate call.
+  void Deallocate(void *ptr, size_t bytes, size_t alignment);
+
+  // Bytes taken from the system: whole slabs and page rounded blocks when
+  // bound to a node. Otherwise, on glibc, the malloc chunks with their
+  // header and rounding, leaving out only the slack of a larger free chunk
+  // reused for a small block; elsewhere just the requested sizes.
+  int64 bytes_reserved() const { return bytes_reserved_; }
+
+  // Upper bound on how much bytes_reserved() grows over a sequence of
+  // Allocate and Deallocate calls, worked out without making them. Small
+  // blocks are served from the free lists first and otherwise carved from
+  // whole slabs, each of which may leave up to kMaxSmallBytes unused at its
+  // end; freed small blocks stay reserved. Other blocks count their rounded
+  // size both ways.
+  class Projection {
+  public:
+    explicit Projection(const NUMAArena *arena) : arena_(arena) {}
+
+    void Allocate(size_t bytes, size_t alignment, size_t count);
+    void Deallocate(size_t bytes, size_t alignment, size_t count);
+
+    int64 growth() const;
+
+  private:
+    const NUMAArena *arena_;
+    // Blocks added to (or taken from) each touched free list.
+    absl::flat_hash_map<size_t, int64> free_delta_;
+    // Small block bytes no free list can serve.
+    int64 slab_bytes_ = 0;
+    int64 block_bytes_ = 0;
+  };
+
+private:
+  static constexpr size_t kPageBytes = 4096;
+  static constexpr size_t kSlabBytes = 256 << 10;
+  static constexpr size_t kMaxSmallBytes = 4 << 10;
+  static constexpr size_t kSmallAlignment = 16;
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  bool IsSmall(size_t bytes, size_t alignment) const {
+    return bytes <= kMaxSmallBytes && alignment <= kSmallAlignment;
+  }
+
+  // Bytes the block `ptr` of `bytes` bytes, not carved from a slab, adds to
+  // bytes_reserved().
+  size_t BlockBytes(void *ptr, size_t bytes) const;
+
+  const NUMAPlacement *placement_;
+  // free_lists_[i] holds the free small blocks of i * kSmallAlignment bytes.
+  std::vector<FreeBlock *> free_lists_;
+  std::vector<size_t> free_counts_;
+  std::vector<void *> slabs_;
+  char *slab_cursor_ = nullptr;
+  char *slab_end_ = nullptr;
+  int64 bytes_reserved_ = 0;
+
+  TF_DISALLOW_COPY_AND_ASSIGN(NUMAArena);
+};
+
+// Standard allocator drawing from a NUMAArena, which must outlive every
+// container using it.
+template <class T> class NUMAAllocator {
+public:
+  using value_type = T;
+  // Swapping or move assigning a container takes the source's arena along,
+  // which is how a compacted table brings its fresh arena.
+  using propagate_on_container_swap = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+
+  explicit NUMAAllocator(NUMAArena *arena) : arena_(arena) {}
+
+  template <class U>
+  NUMAAllocator(const NUMAAllocator<U> &other) : arena_(other.arena()) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena_->Allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, size_t n) {
+    arena_->Deallocate(ptr, n * sizeof(T), alignof(T));
+  }
+
+  NUMAArena *arena() const { return arena_; }
+
+private:
+  NUMAArena *arena_;
+};
+
+template <class T, class U>
+bool operator==(const NUMAAllocator<T> &a, const NUMAAllocator<U> &b) {
+  return a.arena() == b.arena();
+}
+
+template <class T, class U>
+bool operator!=(const NUMAAllocator<T> &a, const NUMAAllocator<U> &b) {
+  return !(a == b);
+}
+
+} // namespace byteps
+} // namespace tensorflow
+#endif // TFOP_SRC_MAIN_KERNELS_PS_NUMA_H_
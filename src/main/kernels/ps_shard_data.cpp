@@ -63,5 +63,32 @@ Status CheckShardDataTypes(const PSShard &shard, DataType key_dtype,
   return Status::OK();
 }
 
+constexpr size_t PartitionGroups::kMaxCachedKeys;
+
+PartitionGroups *PartitionGroups::ThreadLocal() {
+  static thread_local PartitionGroups groups;
+  return &groups;
+}
+
+void PartitionGroups::Trim() {
+  if (order.capacity() > kMaxCachedKeys) {
+    std::vector<size_t>().swap(partition_of);
+    std::vector<int64>().swap(order);
+  }
+}
+
+Status ParseCombiner(const string &name, Combiner *combiner) {
+  if (name == "sum") {
+    *combiner = Combiner::kSum;
+  } else if (name == "mean") {
+    *combiner = Combiner::kMean;
+  } else if (name == "sqrtn") {
+    *combiner = Combiner::kSqrtN;
+  } else {
+    return errors::InvalidArgument("Unknown combiner: ", name);
+  }
+  return Status::OK();
+}
+
 } // namespace byteps
 } // namespace tensorflow
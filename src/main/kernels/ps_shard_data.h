@@ -2,11 +2,24 @@
 #define TFOP_SRC_MAIN_KERNELS_PS_SHARD_DATA_CPP_
 #define EIGEN_USE_THREADS
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <numeric>
 #include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "ps_initializer.h"
+#include "ps_numa.h"
 #include "ps_utils.h"
 #include "tensorflow/core/framework/bounds_check.h"
 #include "tensorflow/core/framework/lookup_interface.h"
@@ -19,15 +32,23 @@
 #include "tensorflow/core/framework/variant.h"
 #include "tensorflow/core/lib/core/errors.h"
 #include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/lib/gtl/inlined_vector.h"
 #include "tensorflow/core/lib/gtl/map_util.h"
 #include "tensorflow/core/lib/hash/hash.h"
+#include "tensorflow/core/platform/logging.h"
 #include "tensorflow/core/platform/macros.h"
+#include "tensorflow/core/platform/mem.h"
 #include "tensorflow/core/platform/thread_annotations.h"
 
 namespace tensorflow {
 namespace byteps {
 
+// Reduction applied by PSPullCombine to the values of one segment.
+enum class Combiner { kSum, kMean, kSqrtN };
+
+Status ParseCombiner(const string &name, Combiner *combiner);
+
 class PSShard : public lookup::LookupInterface {
 public:
   TensorShape key_shape() const final { return TensorShape(); }
@@ -52,6 +73,38 @@ public:
     return CheckKeyShape(keys.shape());
   }
 
+  // Looks up `keys` and reduces the found values into `value` by
+  // `segment_ids`, so `value` has one row per segment. Each id is scaled by
+  // the matching entry of `weights` unless `weights` is empty. Missing keys
+  // contribute `default_value`.
+  virtual Status FindAndCombine(OpKernelContext *ctx, const Tensor &keys,
+                                const Tensor &segment_ids,
+                                const Tensor &weights,
+                                const Tensor &default_value, Combiner combiner,
+                                Tensor *value) = 0;
+
+  // Like Find, but keys that are missing are inserted with the value
+  // produced by `initializer` and that value is returned.
+  virtual Status FindOrInsert(OpKernelContext *ctx, const Tensor &keys,
+                              Tensor *values,
+                              const PSInitializer &initializer) = 0;
+
+  // Rebuilds, one partition at a time, every partition whose load factor
+  // fell below `min_load_factor` into a right-sized table with a fresh arena,
+  // unless the rebuilt partition would not be smaller. Sets
+  // `reclaimed_bytes` to the net bytes the shard gave back, 0 if nothing was
+  // rebuilt: node bound slabs are unmapped, heap memory is only trimmed as
+  // far as malloc allows.
+  virtual Status Compact(OpKernelContext *ctx, float min_load_factor,
+                         int64 *reclaimed_bytes) = 0;
+
+  // Pool pinned to the NUMA node holding the shard's table, or nullptr if
+  // ops should run on the caller's thread.
+  virtual thread::ThreadPool *worker_pool() const = 0;
+
+  // Buckets over all partitions, to see how far the table outgrew its size.
+  virtual size_t bucket_count() const = 0;
+
 private:
   // virtual ~PSShard() = default;
   Status CheckKeyAndValueTensorsHelper(const Tensor &keys,
@@ -81,13 +134,98 @@ Status GetPSShard(StringPiece input_name, OpKernelContext *ctx,
 Status CheckShardDataTypes(const PSShard &shard, DataType key_dtype,
                            DataType value_dtype, const string &table_name);
 
+// Buffers of PSShardOfScalars::GroupByPartition. Batches use the one
+// instance of their thread, shared by every shard and key type, so they do
+// not allocate. A batch of more than kMaxCachedKeys keys releases the key
+// buffers afterwards, which caps what a thread keeps at about 1 MiB; this
+// memory is not part of any shard's MemoryUsed().
+struct PartitionGroups {
+  static constexpr size_t kMaxCachedKeys = 1 << 16;
+
+  // Buffers of the calling thread. Uses must not nest.
+  static PartitionGroups *ThreadLocal();
+
+  // Releases the key buffers if they grew past kMaxCachedKeys.
+  void Trim();
+
+  std::vector<size_t> partition_of;
+  std::vector<int64> order;
+  std::vector<int64> offsets;
+  std::vector<int64> cursor;
+};
+
 template <class K, class V> class PSShardOfScalars final : public PSShard {
 public:
-  PSShardOfScalars(OpKernelContext *ctx, OpKernel *kernel) {}
+  PSShardOfScalars(OpKernelContext *ctx, OpKernel *kernel) {
+    OP_REQUIRES_OK(ctx, GetNodeAttr(kernel->def(), "memory_budget_bytes",
+                                    &memory_budget_));
+    OP_REQUIRES(ctx, memory_budget_ >= 0,
+                errors::InvalidArgument(
+                    "memory_budget_bytes must be >= 0, got ", memory_budget_));
+
+    // The tables are created below, so every node and bucket array lands on
+    // the placement parsed here.
+    string numa_node;
+    OP_REQUIRES_OK(ctx, GetNodeAttr(kernel->def(), "numa_node", &numa_node));
+    OP_REQUIRES_OK(ctx, placement_.Parse(numa_node));
+
+    int num_threads;
+    OP_REQUIRES_OK(
+        ctx, GetNodeAttr(kernel->def(), "num_numa_threads", &num_threads));
+    OP_REQUIRES(ctx, num_threads >= 0,
+                errors::InvalidArgument(
+                    "num_numa_threads must be >= 0, got ", num_threads));
+    if (num_threads > 0) {
+      ThreadOptions options;
+      options.numa_node = placement_.node();
+      worker_pool_.reset(new thread::ThreadPool(
+          ctx->env(), options, "ps_shard_worker", num_threads));
+    }
+
+    int num_partitions;
+    OP_REQUIRES_OK(ctx, GetNodeAttr(kernel->def(), "num_partitions",
+                                    &num_partitions));
+    OP_REQUIRES(ctx, num_partitions >= 1,
+                errors::InvalidArgument(
+                    "num_partitions must be >= 1, got ", num_partitions));
+    // Fixed metadata plus whatever the arenas take from the system.
+    int64 memory_used =
+        sizeof(PSShardOfScalars) +
+        num_partitions *
+            (sizeof(void *) + sizeof(Partition) + sizeof(NUMAArena));
+    partitions_.reserve(num_partitions);
+    for (int p = 0; p < num_partitions; ++p) {
+      partitions_.emplace_back(new Partition(&placement_));
+      memory_used += partitions_.back()->arena->bytes_reserved();
+    }
+    memory_used_.store(memory_used, std::memory_order_relaxed);
+  }
+
+  ~PSShardOfScalars() override {
+    // The last reference can be dropped by an op running on the worker pool,
+    // and a pool cannot join its own threads, so delete it from elsewhere.
+    if (worker_pool_ != nullptr && worker_pool_->CurrentThreadId() != -1) {
+      thread::ThreadPool *pool = worker_pool_.release();
+      Env::Default()->SchedClosure([pool]() { delete pool; });
+    }
+  }
 
   size_t size() const override {
-    tf_shared_lock l(mu_);
-    return table_.size();
+    size_t ret = 0;
+    for (const auto &partition : partitions_) {
+      tf_shared_lock l(partition->mu);
+      ret += partition->table.size();
+    }
+    return ret;
+  }
+
+  size_t bucket_count() const override {
+    size_t ret = 0;
+    for (const auto &partition : partitions_) {
+      tf_shared_lock l(partition->mu);
+      ret += partition->table.bucket_count();
+    }
+    return ret;
   }
 
   Status Find(OpKernelContext *ctx, const Tensor &key, Tensor *value,
@@ -100,46 +238,207 @@ public:
     int64 default_total = default_flat.size();
     bool is_full_size_default = (total == default_total);
 
-    tf_shared_lock l(mu_);
+    return ForEachPartition(
+        key_values.data(), key_values.size(),
+        [&](Partition *partition, const int64 *positions, int64 count) {
+          tf_shared_lock l(partition->mu);
+          const Table &table = partition->table;
+          for (int64 j = 0; j < count; ++j) {
+            const int64 i = Position(positions, j);
+            // is_full_size_default is true:
+            //   Each key has an independent default value, key_values(i)
+            //   corresponding uses default_flat(i) as its default value.
+            //
+            // is_full_size_default is false:
+            //   All keys will share the default_flat(0) as default value.
+            value_values(i) = gtl::FindWithDefault(
+                table, SubtleMustCopyIfIntegral(key_values(i)),
+                is_full_size_default ? default_flat(i) : default_flat(0));
+
+            if (VLOG_IS_ON(2)) {
+              auto got = table.find(key_values(i));
+              if (got != table.end()) {
+                VLOG(2) << "find key: " << key_values(i)
+                        << "\tvalue: " << got->second;
+              } else {
+                VLOG(2) << "find key: " << key_values(i) << "\tnot found";
+              }
+            }
+          }
+          return Status::OK();
+        });
+  }
+
+  Status FindAndCombine(OpKernelContext *ctx, const Tensor &keys,
+                        const Tensor &segment_ids, const Tensor &weights,
+                        const Tensor &default_value, Combiner combiner,
+                        Tensor *value) override {
+    const auto key_values = keys.flat<K>();
+    const auto segment_values = segment_ids.flat<int64>();
+    const auto weight_values = weights.flat<V>();
+    const V default_v = default_value.flat<V>()(0);
+    auto value_values = value->flat<V>();
+
+    const int64 num_segments = value_values.size();
+    const bool has_weights = weight_values.size() > 0;
+
+    for (int64 i = 0; i < segment_values.size(); ++i) {
+      if (!FastBoundsCheck(segment_values(i), num_segments)) {
+        return errors::InvalidArgument("segment_ids[", i,
+                                       "] = ", segment_values(i),
+                                       " is not in [0, ", num_segments, ")");
+      }
+    }
+
+    // Sum of weights for mean, sum of squared weights for sqrtn.
+    std::vector<double> norms(
+        combiner == Combiner::kSum ? 0 : static_cast<size_t>(num_segments),
+        0.0);
+    value_values.setZero();
+
+    // Look the ids up one partition lock at a time, so a partition being
+    // compacted only delays the ids it owns, then reduce in id order
+    // without any lock so float sums do not depend on the partitioning.
+    std::vector<V> found(static_cast<size_t>(key_values.size()));
+    TF_RETURN_IF_ERROR(ForEachPartition(
+        key_values.data(), key_values.size(),
+        [&](Partition *partition, const int64 *positions, int64 count) {
+          tf_shared_lock l(partition->mu);
+          const Table &table = partition->table;
+          for (int64 j = 0; j < count; ++j) {
+            const int64 i = Position(positions, j);
+            auto got = table.find(key_values(i));
+            found[i] = got == table.end() ? default_v : got->second;
+          }
+          return Status::OK();
+        }));
+
     for (int64 i = 0; i < key_values.size(); ++i) {
-      // is_full_size_default is true:
-      //   Each key has an independent default value, key_values(i)
-      //   corresponding uses default_flat(i) as its default value.
-      //
-      // is_full_size_default is false:
-      //   All keys will share the default_flat(0) as default value.
-      value_values(i) = gtl::FindWithDefault(
-          table_, SubtleMustCopyIfIntegral(key_values(i)),
-          is_full_size_default ? default_flat(i) : default_flat(0));
-
-      auto got = table_.find(key_values(i));
-      if (got != table_.end()) {
-        std::cout << "find key: " << key_values(i) << "\tvalue: " << got->second
-                  << std::endl;
-      } else {
-        std::cout << "find key: " << key_values(i) << "\tnot found"
-                  << std::endl;
+      const int64 segment = segment_values(i);
+      const V w = has_weights ? weight_values(i) : static_cast<V>(1);
+      value_values(segment) += found[i] * w;
+      if (combiner == Combiner::kMean) {
+        norms[segment] += static_cast<double>(w);
+      } else if (combiner == Combiner::kSqrtN) {
+        norms[segment] += static_cast<double>(w) * static_cast<double>(w);
       }
     }
 
+    if (combiner != Combiner::kSum) {
+      for (int64 s = 0; s < num_segments; ++s) {
+        if (norms[s] > 0) {
+          const double norm =
+              combiner == Combiner::kMean ? norms[s] : std::sqrt(norms[s]);
+          value_values(s) = static_cast<V>(value_values(s) / norm);
+        }
+      }
+    }
     return Status::OK();
   }
 
+  Status FindOrInsert(OpKernelContext *ctx, const Tensor &keys,
+                      Tensor *values,
+                      const PSInitializer &initializer) override {
+    const auto key_values = keys.flat<K>();
+    auto value_values = values->flat<V>();
+
+    // Resolve the hits under the shared locks and remember the cold ids.
+    std::vector<int64> missing;
+    TF_RETURN_IF_ERROR(ForEachPartition(
+        key_values.data(), key_values.size(),
+        [&](Partition *partition, const int64 *positions, int64 count) {
+          tf_shared_lock l(partition->mu);
+          for (int64 j = 0; j < count; ++j) {
+            const int64 i = Position(positions, j);
+            auto got = partition->table.find(key_values(i));
+            if (got != partition->table.end()) {
+              value_values(i) = got->second;
+            } else {
+              missing.push_back(i);
+            }
+          }
+          return Status::OK();
+        }));
+    if (missing.empty()) {
+      return Status::OK();
+    }
+
+    // Initial values are generated outside the locks in one batch.
+    const int64 num_missing = static_cast<int64>(missing.size());
+    std::vector<K> missing_keys(missing.size());
+    std::vector<V> initial_values(missing.size());
+    for (int64 j = 0; j < num_missing; ++j) {
+      missing_keys[j] = key_values(missing[j]);
+    }
+    initializer.Generate(missing_keys.data(), num_missing,
+                         initial_values.data());
+
+    return ForEachPartition(
+        missing_keys.data(), num_missing,
+        [&](Partition *partition, const int64 *positions, int64 count) {
+          mutex_lock l(partition->mu);
+          Table &table = partition->table;
+          int64 reserved = 0;
+          if (memory_budget_ > 0) {
+            const size_t num_new =
+                CountNewKeys(&table, missing_keys.data(), positions, count);
+            reserved = std::max<int64>(
+                0, EstimatedGrowth(*partition, table.size() + num_new,
+                                   /*clear=*/false));
+            TF_RETURN_IF_ERROR(ReserveMemory(reserved));
+          }
+          const int64 bytes_before = partition->arena->bytes_reserved();
+          for (int64 j = 0; j < count; ++j) {
+            const int64 m = Position(positions, j);
+            // The key may have been pushed since the shared pass; keep that
+            // value.
+            auto inserted = table.emplace(missing_keys[m], initial_values[m]);
+            value_values(missing[m]) = inserted.first->second;
+          }
+          AddMemoryUsed(partition->arena->bytes_reserved() - bytes_before -
+                        reserved);
+          return Status::OK();
+        });
+  }
+
+  // Partitions are updated one at a time. When the memory budget rejects a
+  // partition, the partitions before it keep the new values; a retry of the
+  // whole batch is idempotent. With `clear`, see ReplaceAll.
   Status DoInsert(bool clear, const Tensor &keys, const Tensor &values) {
     const auto key_values = keys.flat<K>();
     const auto value_values = values.flat<V>();
 
-    mutex_lock l(mu_);
     if (clear) {
-      table_.clear();
-    }
-    for (int64 i = 0; i < key_values.size(); ++i) {
-      gtl::InsertOrUpdate(&table_, SubtleMustCopyIfIntegral(key_values(i)),
-                          SubtleMustCopyIfIntegral(value_values(i)));
-      std::cout << "insert key: " << key_values(i)
-                << "\tvalue: " << value_values(i) << std::endl;
+      return ReplaceAll(key_values.data(), value_values.data(),
+                        key_values.size());
     }
-    return Status::OK();
+
+    return ForEachPartition(
+        key_values.data(), key_values.size(),
+        [&](Partition *partition, const int64 *positions, int64 count) {
+          mutex_lock l(partition->mu);
+          Table &table = partition->table;
+          int64 reserved = 0;
+          if (memory_budget_ > 0) {
+            const size_t num_new =
+                CountNewKeys(&table, key_values.data(), positions, count);
+            reserved = std::max<int64>(
+                0, EstimatedGrowth(*partition, table.size() + num_new,
+                                   /*clear=*/false));
+            TF_RETURN_IF_ERROR(ReserveMemory(reserved));
+          }
+          const int64 bytes_before = partition->arena->bytes_reserved();
+          for (int64 j = 0; j < count; ++j) {
+            const int64 i = Position(positions, j);
+            gtl::InsertOrUpdate(&table, SubtleMustCopyIfIntegral(key_values(i)),
+                                SubtleMustCopyIfIntegral(value_values(i)));
+            VLOG(2) << "insert key: " << key_values(i)
+                    << "\tvalue: " << value_values(i);
+          }
+          AddMemoryUsed(partition->arena->bytes_reserved() - bytes_before -
+                        reserved);
+          return Status::OK();
+        });
   }
 
   Status Insert(OpKernelContext *ctx, const Tensor &keys,
@@ -148,6 +447,65 @@ public:
   }
 
   Status Remove(OpKernelContext *ctx, const Tensor &keys) override {
+    const auto key_values = keys.flat<K>();
+    return ForEachPartition(
+        key_values.data(), key_values.size(),
+        [&](Partition *partition, const int64 *positions, int64 count) {
+          mutex_lock l(partition->mu);
+          Table &table = partition->table;
+          const int64 bytes_before = partition->arena->bytes_reserved();
+          for (int64 j = 0; j < count; ++j) {
+            table.erase(key_values(Position(positions, j)));
+          }
+          AddMemoryUsed(partition->arena->bytes_reserved() - bytes_before);
+          return Status::OK();
+        });
+  }
+
+  Status Compact(OpKernelContext *ctx, float min_load_factor,
+                 int64 *reclaimed_bytes) override {
+    int64 reclaimed = 0;
+    for (auto &partition : partitions_) {
+      // Only this partition is blocked while it is rebuilt.
+      mutex_lock l(partition->mu);
+      Table &table = partition->table;
+      if (table.bucket_count() <= 1 || table.load_factor() >= min_load_factor) {
+        continue;
+      }
+
+      const int64 bytes_before = partition->arena->bytes_reserved();
+      // A fresh arena takes whole slabs, so a few survivors can cost as much
+      // as the sparse table; leave a partition alone unless it shrinks.
+      if (CompactedBytes(table) >= bytes_before) {
+        continue;
+      }
+      // The surviving entries move to a table drawing from a fresh arena, so
+      // dropping the old table and then its arena frees every old node and
+      // slab, not only the slabs that happen to be empty.
+      std::unique_ptr<NUMAArena> arena(new NUMAArena(&placement_));
+      {
+        Table compacted(0, table.hash_function(), table.key_eq(),
+                        Allocator(arena.get()));
+        compacted.reserve(table.size());
+        compacted.insert(table.begin(), table.end());
+        table.swap(compacted);
+      }
+      partition->arena.swap(arena);
+      arena.reset();
+      const int64 freed = bytes_before - partition->arena->bytes_reserved();
+      AddMemoryUsed(-freed);
+      reclaimed += freed;
+    }
+
+    if (reclaimed > 0) {
+      // A no-op unless TF is built with tcmalloc; glibc needs malloc_trim to
+      // hand free heap pages back to the OS.
+      port::MallocExtension_ReleaseToSystem(static_cast<size_t>(reclaimed));
+#ifdef __GLIBC__
+      malloc_trim(0);
+#endif
+    }
+    *reclaimed_bytes = reclaimed;
     return Status::OK();
   }
 
@@ -157,8 +515,18 @@ public:
   }
 
   Status ExportValues(OpKernelContext *ctx) override {
-    tf_shared_lock l(mu_);
-    int64 size = table_.size();
+    // Partitions are copied one at a time so exporting never blocks the
+    // whole shard.
+    std::vector<K> exported_keys;
+    std::vector<V> exported_values;
+    for (const auto &partition : partitions_) {
+      tf_shared_lock l(partition->mu);
+      for (const auto &entry : partition->table) {
+        exported_keys.push_back(entry.first);
+        exported_values.push_back(entry.second);
+      }
+    }
+    int64 size = static_cast<int64>(exported_keys.size());
 
     Tensor *keys;
     Tensor *values;
@@ -169,26 +537,19 @@ public:
 
     auto keys_data = keys->flat<K>();
     auto values_data = values->flat<V>();
-    int64 i = 0;
-    for (auto it = table_.begin(); it != table_.end(); ++it, ++i) {
-      keys_data(i) = it->first;
-      values_data(i) = it->second;
+    for (int64 i = 0; i < size; ++i) {
+      keys_data(i) = exported_keys[i];
+      values_data(i) = exported_values[i];
     }
     return Status::OK();
   }
 
   int64 MemoryUsed() const override {
-    int64 ret = 0;
-    tf_shared_lock l(mu_);
-    for (unsigned i = 0; i < table_.bucket_count(); ++i) {
-      size_t bucket_size = table_.bucket_size(i);
-      if (bucket_size == 0) {
-        ret++;
-      } else {
-        ret += bucket_size;
-      }
-    }
-    return sizeof(PSShardOfScalars) + ret;
+    return memory_used_.load(std::memory_order_relaxed);
+  }
+
+  thread::ThreadPool *worker_pool() const override {
+    return worker_pool_.get();
   }
 
   DataType key_dtype() const override { return DataTypeToEnum<K>::v(); }
@@ -196,9 +557,253 @@ public:
   DataType value_dtype() const override { return DataTypeToEnum<V>::v(); }
 
 private:
-  // virtual ~PSShardOfScalars() = default;
-  mutable mutex mu_;
-  std::unordered_map<K, V> table_;
+  using Allocator = NUMAAllocator<std::pair<const K, V>>;
+  using Table =
+      std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, Allocator>;
+
+  // Keys are spread over independently locked partitions, so batches take
+  // each lock once and compaction blocks one partition at a time.
+  struct Partition {
+    explicit Partition(const NUMAPlacement *placement)
+        : arena(new NUMAArena(placement)),
+          table(0, std::hash<K>(), std::equal_to<K>(),
+                Allocator(arena.get())) {}
+
+    mutable mutex mu;
+    // Declared before table so it outlives every allocation of the table.
+    std::unique_ptr<NUMAArena> arena;
+    Table table GUARDED_BY(mu);
+  };
+
+  size_t PartitionOf(K key) const {
+    // std::hash is the identity for integers, so mix the key before taking
+    // the modulus to keep clustered ids apart.
+    return static_cast<size_t>(
+        (static_cast<uint64>(key) * 0x9E3779B97F4A7C15ULL >> 32) %
+        partitions_.size());
+  }
+
+  // Replaces the content of the shard with keys[0, n) and values[0, n). The
+  // budget is checked for the whole import before any partition is touched,
+  // then each partition is cleared and refilled in one pass under its own
+  // lock, so readers may see some partitions reloaded and others not yet.
+  Status ReplaceAll(const K *keys, const V *values, int64 n) {
+    PartitionGroups groups;
+    GroupByPartition(keys, n, &groups);
+
+    // Only partitions that grow reserve budget; the ones that shrink give
+    // their bytes back as they are refilled.
+    std::vector<int64> reserved(partitions_.size(), 0);
+    if (memory_budget_ > 0) {
+      int64 total = 0;
+      for (size_t p = 0; p < partitions_.size(); ++p) {
+        const size_t num_entries =
+            CountNewKeys(nullptr, keys, groups.order.data() + groups.offsets[p],
+                         groups.offsets[p + 1] - groups.offsets[p]);
+        const Partition &partition = *partitions_[p];
+        tf_shared_lock l(partition.mu);
+        reserved[p] = std::max<int64>(
+            0, EstimatedGrowth(partition, num_entries, /*clear=*/true));
+        total += reserved[p];
+      }
+      TF_RETURN_IF_ERROR(ReserveMemory(total));
+    }
+
+    for (size_t p = 0; p < partitions_.size(); ++p) {
+      Partition *partition = partitions_[p].get();
+      mutex_lock l(partition->mu);
+      Table &table = partition->table;
+      const int64 bytes_before = partition->arena->bytes_reserved();
+      table.clear();
+      for (int64 j = groups.offsets[p]; j < groups.offsets[p + 1]; ++j) {
+        const int64 i = groups.order[j];
+        gtl::InsertOrUpdate(&table, SubtleMustCopyIfIntegral(keys[i]),
+                            SubtleMustCopyIfIntegral(values[i]));
+        VLOG(2) << "insert key: " << keys[i] << "\tvalue: " << values[i];
+      }
+      AddMemoryUsed(partition->arena->bytes_reserved() - bytes_before -
+                    reserved[p]);
+    }
+    return Status::OK();
+  }
+
+  // Groups keys[0, n) by partition with a counting sort: the positions of
+  // the keys of partition p end up in order[offsets[p], offsets[p + 1]).
+  void GroupByPartition(const K *keys, int64 n, PartitionGroups *groups) const {
+    const size_t num_partitions = partitions_.size();
+    groups->partition_of.resize(static_cast<size_t>(n));
+    groups->order.resize(static_cast<size_t>(n));
+    groups->offsets.assign(num_partitions + 1, 0);
+    for (int64 i = 0; i < n; ++i) {
+      groups->partition_of[i] = PartitionOf(keys[i]);
+      ++groups->offsets[groups->partition_of[i] + 1];
+    }
+    for (size_t p = 0; p < num_partitions; ++p) {
+      groups->offsets[p + 1] += groups->offsets[p];
+    }
+    groups->cursor.assign(groups->offsets.begin(),
+                          groups->offsets.end() - 1);
+    for (int64 i = 0; i < n; ++i) {
+      groups->order[groups->cursor[groups->partition_of[i]]++] = i;
+    }
+  }
+
+  // Position of the j-th key given to a ForEachPartition callback.
+  static int64 Position(const int64 *positions, int64 j) {
+    return positions == nullptr ? j : positions[j];
+  }
+
+  // Calls fn(partition, positions, count) for every partition that owns at
+  // least one of keys[0, n), where the keys of that partition are at
+  // Position(positions, 0 .. count). A batch within a single partition is
+  // passed as is with null positions, without sorting. Stops at the first
+  // error. `fn` must not call ForEachPartition itself.
+  template <class Fn>
+  Status ForEachPartition(const K *keys, int64 n, Fn fn) const {
+    if (n == 0) {
+      return Status::OK();
+    }
+    const size_t first = PartitionOf(keys[0]);
+    int64 same = 1;
+    while (same < n && PartitionOf(keys[same]) == first) {
+      ++same;
+    }
+    if (same == n) {
+      return fn(partitions_[first].get(), nullptr, n);
+    }
+
+    PartitionGroups *groups = PartitionGroups::ThreadLocal();
+    GroupByPartition(keys, n, groups);
+    Status status;
+    for (size_t p = 0; p < partitions_.size() && status.ok(); ++p) {
+      const int64 count = groups->offsets[p + 1] - groups->offsets[p];
+      if (count > 0) {
+        status = fn(partitions_[p].get(),
+                    groups->order.data() + groups->offsets[p], count);
+      }
+    }
+    groups->Trim();
+    return status;
+  }
+
+  // A libstdc++ hash node: the next pointer and the key/value pair, with no
+  // cached hash code since std::hash of a scalar is cheap.
+  static constexpr size_t kNodeBytes =
+      sizeof(void *) + sizeof(std::pair<const K, V>);
+  static constexpr size_t kNodeAlignment =
+      std::max(alignof(void *), alignof(std::pair<const K, V>));
+
+  // Upper bound on the bytes the arena of `partition` takes from the system
+  // while its table, first cleared if `clear`, grows to `num_entries` entries
+  // one insert at a time. Negative when clearing gives back more than the
+  // refill takes. libstdc++ sizes the first bucket array for 11 entries and,
+  // whenever an insert crosses the max load factor, replaces it with one of
+  // the next prime of at least twice its size; every array on the way is
+  // allocated, so small ones stay in the arena's free lists.
+  static int64 EstimatedGrowth(const Partition &partition, size_t num_entries,
+                               bool clear)
+      SHARED_LOCKS_REQUIRED(partition.mu) {
+    const Table &table = partition.table;
+    NUMAArena::Projection projection(partition.arena.get());
+    const size_t kept = clear ? 0 : table.size();
+    if (clear) {
+      projection.Deallocate(kNodeBytes, kNodeAlignment, table.size());
+    }
+    if (num_entries > kept) {
+      projection.Allocate(kNodeBytes, kNodeAlignment, num_entries - kept);
+    }
+
+    const double max_load_factor = table.max_load_factor();
+    size_t buckets = table.bucket_count();
+#ifdef __GLIBCXX__
+    const std::__detail::_Prime_rehash_policy policy(max_load_factor);
+#endif
+    while (num_entries > 0 &&
+           (buckets <= 1 || num_entries > buckets * max_load_factor)) {
+      const size_t target = std::max<size_t>(buckets * 2, 12);
+#ifdef __GLIBCXX__
+      const size_t next = policy._M_next_bkt(target);
+#else
+      const size_t next = target;
+#endif
+      projection.Allocate(next * sizeof(void *), alignof(void *), 1);
+      // A single bucket lives inside the table, not in the arena.
+      if (buckets > 1) {
+        projection.Deallocate(buckets * sizeof(void *), alignof(void *), 1);
+      }
+      buckets = next;
+    }
+    return projection.growth();
+  }
+
+  // Number of distinct keys among keys[Position(positions, 0 .. count)]
+  // that are not in `table` yet, or of all of them if `table` is null.
+  static size_t CountNewKeys(const Table *table, const K *keys,
+                             const int64 *positions, int64 count) {
+    absl::flat_hash_set<K> new_keys;
+    for (int64 j = 0; j < count; ++j) {
+      const K key = keys[Position(positions, j)];
+      if (table == nullptr || table->count(key) == 0) {
+        new_keys.insert(key);
+      }
+    }
+    return new_keys.size();
+  }
+
+  // Upper bound on the bytes a fresh arena takes for a copy of `table`
+  // sized with reserve(table.size()), as Compact builds it.
+  int64 CompactedBytes(const Table &table) const {
+    NUMAArena empty(&placement_);
+    NUMAArena::Projection projection(&empty);
+    projection.Allocate(kNodeBytes, kNodeAlignment, table.size());
+    const size_t min_buckets = static_cast<size_t>(
+        std::ceil(table.size() / table.max_load_factor()));
+#ifdef __GLIBCXX__
+    const std::__detail::_Prime_rehash_policy policy(table.max_load_factor());
+    const size_t buckets = policy._M_next_bkt(std::max<size_t>(min_buckets, 1));
+#else
+    const size_t buckets = min_buckets;
+#endif
+    if (buckets > 1) {
+      projection.Allocate(buckets * sizeof(void *), alignof(void *), 1);
+    }
+    return projection.growth();
+  }
+
+  void AddMemoryUsed(int64 delta) {
+    memory_used_.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  // Adds `bytes` to memory_used_ ahead of a mutation, unless that takes the
+  // shard over its memory budget, which fails with a retryable
+  // ResourceExhausted. Reserving atomically keeps batches on different
+  // partitions from passing the check together and overshooting the budget.
+  // The caller settles with AddMemoryUsed(actual_growth - bytes).
+  Status ReserveMemory(int64 bytes) {
+    int64 used = memory_used_.load(std::memory_order_relaxed);
+    do {
+      if (used + bytes > memory_budget_) {
+        return errors::ResourceExhausted(
+            "PS shard would use ", used + bytes,
+            " bytes, over its memory budget of ", memory_budget_,
+            " bytes. Remove keys or raise memory_budget_bytes and retry.");
+      }
+    } while (!memory_used_.compare_exchange_weak(used, used + bytes,
+                                                 std::memory_order_relaxed));
+    return Status::OK();
+  }
+
+  // Declared first so it outlives every allocation of the tables.
+  NUMAPlacement placement_;
+  std::vector<std::unique_ptr<Partition>> partitions_;
+  std::unique_ptr<thread::ThreadPool> worker_pool_;
+
+  // Fixed metadata plus the bytes the arenas took from the system, allocator
+  // overhead included as far as NUMAArena::bytes_reserved() sees it. Updated
+  // after every mutation so MemoryUsed() is O(1) and lock free. While a
+  // mutation runs it also holds that mutation's budget reservation.
+  std::atomic<int64> memory_used_{0};
+  int64 memory_budget_ = 0;
 };
 
 } // namespace byteps
@@ -9,6 +9,10 @@ REGISTER_OP("GetPSHandle")
     .Attr("use_node_name_sharing: bool = false")
     .Attr("key_dtype: type")
     .Attr("value_dtype: type")
+    .Attr("memory_budget_bytes: int = 0")
+    .Attr("numa_node: string = ''")
+    .Attr("num_numa_threads: int = 0")
+    .Attr("num_partitions: int = 16")
     .SetIsStateful()
     .SetShapeFn(TwoElementOutput);
 
@@ -19,6 +23,14 @@ REGISTER_OP("PSPull")
     .Output("values: Tout")
     .Attr("Tin: type")
     .Attr("Tout: type")
+    .Attr("insert_on_miss: bool = false")
+    .Attr("initializer: {'zeros', 'uniform', 'truncated_normal'} = 'zeros'")
+    .Attr("init_minval: float = -0.05")
+    .Attr("init_maxval: float = 0.05")
+    .Attr("init_mean: float = 0.0")
+    .Attr("init_stddev: float = 0.05")
+    .Attr("seed: int = 0")
+    .SetIsStateful()
     .SetShapeFn([](InferenceContext *c) {
       ShapeHandle handle;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &handle));
@@ -35,6 +47,39 @@ REGISTER_OP("PSPull")
       return Status::OK();
     });
 
+REGISTER_OP("PSPullCombine")
+    .Input("byte_ps_shard: Ref(string)")
+    .Input("keys: Tin")
+    .Input("segment_ids: int64")
+    .Input("weights: Tout")
+    .Input("num_segments: int64")
+    .Input("default_value: Tout")
+    .Output("values: Tout")
+    .Attr("Tin: type")
+    .Attr("Tout: type")
+    .Attr("combiner: {'sum', 'mean', 'sqrtn'} = 'mean'")
+    .SetShapeFn([](InferenceContext *c) {
+      ShapeHandle handle;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &handle));
+      DimensionHandle unused_dim;
+      TF_RETURN_IF_ERROR(c->WithValue(c->Dim(handle, 0), 2, &unused_dim));
+
+      ShapeHandle keys;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &keys));
+      ShapeHandle segment_ids;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 1, &segment_ids));
+      TF_RETURN_IF_ERROR(c->Merge(keys, segment_ids, &keys));
+      ShapeHandle unused;
+      TF_RETURN_IF_ERROR(c->WithRankAtMost(c->input(3), 1, &unused));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(4), 0, &unused));
+
+      // Ids are reduced into one row per segment.
+      DimensionHandle num_segments;
+      TF_RETURN_IF_ERROR(c->MakeDimForScalarInput(4, &num_segments));
+      c->set_output(0, c->Vector(num_segments));
+      return Status::OK();
+    });
+
 REGISTER_OP("PSPush")
     .Input("byte_ps_shard: Ref(string)")
     .Input("keys: Tin")
@@ -51,6 +96,57 @@ REGISTER_OP("PSPush")
       return Status::OK();
     });
 
+REGISTER_OP("PSRemove")
+    .Input("byte_ps_shard: Ref(string)")
+    .Input("keys: Tin")
+    .Attr("Tin: type")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext *c) {
+      ShapeHandle handle;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &handle));
+      DimensionHandle unused_dim;
+      TF_RETURN_IF_ERROR(c->WithValue(c->Dim(handle, 0), 2, &unused_dim));
+      return Status::OK();
+    });
+
+// Rebuilds the sparse partitions of a shard and outputs the net bytes the
+// shard gave back. Partitions a rebuild would not shrink, such as a few
+// entries left in a slab of a node bound arena, are skipped, so the output
+// can be 0; it is only negative where the bucket growth of the standard
+// library is not modelled (not libstdc++). Node bound slabs are unmapped;
+// heap memory is trimmed with malloc_trim on glibc, so pages return to the
+// OS as far as fragmentation of the process heap allows.
+REGISTER_OP("PSCompact")
+    .Input("byte_ps_shard: Ref(string)")
+    .Output("reclaimed_bytes: int64")
+    .Attr("min_load_factor: float = 0.25")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext *c) {
+      ShapeHandle handle;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &handle));
+      DimensionHandle unused_dim;
+      TF_RETURN_IF_ERROR(c->WithValue(c->Dim(handle, 0), 2, &unused_dim));
+      c->set_output(0, c->Scalar());
+      return Status::OK();
+    });
+
+REGISTER_OP("PSShardStats")
+    .Input("byte_ps_shard: Ref(string)")
+    .Output("size: int64")
+    .Output("memory_used: int64")
+    .Output("bucket_count: int64")
+    .SetIsStateful()
+    .SetShapeFn([](InferenceContext *c) {
+      ShapeHandle handle;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &handle));
+      DimensionHandle unused_dim;
+      TF_RETURN_IF_ERROR(c->WithValue(c->Dim(handle, 0), 2, &unused_dim));
+      c->set_output(0, c->Scalar());
+      c->set_output(1, c->Scalar());
+      c->set_output(2, c->Scalar());
+      return Status::OK();
+    });
+
 REGISTER_OP("PSLoad")
     .Input("byte_ps_shard: Ref(string)")
     .Input("keys: Tin")